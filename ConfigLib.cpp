@@ -4,6 +4,40 @@
 // Arduino libraries referenced by this library - need to include these in your sketch too 
 #include <EEPROM.h>
 
+#ifdef __AVR__
+	#include <avr/eeprom.h>
+	#include <util/atomic.h>
+#endif
+
+// Atomic access to the config snapshot state.
+// AVR's runtime has no atomics wider than a byte, but it is single core, so an access made with
+// interrupts disabled is atomic and a compiler barrier is all the ordering that's needed.
+#ifdef __AVR__
+template<class T> static inline T configAtomicLoad(const T* ptr)
+{
+	T value;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		value = *(const volatile T*) ptr;
+	}
+	return value;
+}
+
+template<class T> static inline void configAtomicStore(T* ptr, T value)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*(volatile T*) ptr = value;
+	}
+}
+
+	#define CONFIG_ATOMIC_LOAD(ptr, order) configAtomicLoad(ptr)
+	#define CONFIG_ATOMIC_STORE(ptr, value, order) configAtomicStore(ptr, value)
+	#define CONFIG_ATOMIC_FENCE(order) __asm__ __volatile__("" ::: "memory")
+#else
+	#define CONFIG_ATOMIC_LOAD(ptr, order) __atomic_load_n(ptr, order)
+	#define CONFIG_ATOMIC_STORE(ptr, value, order) __atomic_store_n(ptr, value, order)
+	#define CONFIG_ATOMIC_FENCE(order) __atomic_thread_fence(order)
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 
@@ -87,87 +121,192 @@ int Configurator::readLineFromSerial(int readch, char*buffer, int bufferLen)
 //
 //	EPROM format is a collection of blocks starting at EPROM_CONFIG_START
 //  
-//  Each block starts with a magic string "MGGG"
+//  Each block starts with a magic string "MGG2"
 //  Next comes a block tag of 4 characters e.g. "MBT1"
 //  Then a byte for the block length
+//  Then two bytes (low byte first) for the layout id of the data
+//  Then a byte for the schema version of the data
 //  Then the actual data 
 //  Then a checksum
 //
+//  Blocks written by earlier versions of the library start with "MGGG" and have no layout id
+//  or schema version. They are still read, as schema version 0 with no layout id, so that
+//  they can be migrated.
+//
 // *********************************************************************************************
 
-#define EPROM_BLOCK_START_MAGIC_STRING "MGGG"
+#define EPROM_BLOCK_START_MAGIC_STRING "MGG2"
+#define EPROM_LEGACY_BLOCK_START_MAGIC_STRING "MGGG"
 #define EPROM_BLOCK_START_MAGIC_STRING_LEN 4
 #define EPROM_CONFIG_START 0
 #define EPROM_CONFIG_END   1024
 
+// the two magic strings only differ in their last byte, which the scanner relies on
+#define EPROM_MAGIC_LAST_BYTE (EPROM_BLOCK_START_MAGIC_STRING_LEN - 1)
+
+#define EPROM_BLOCK_HEADER_LEN (EPROM_BLOCK_START_MAGIC_STRING_LEN + EPROM_TAG_SIZE + 1 + 2 + 1)
+#define EPROM_LEGACY_BLOCK_HEADER_LEN (EPROM_BLOCK_START_MAGIC_STRING_LEN + EPROM_TAG_SIZE + 1)
+static_assert(EPROM_BLOCK_OVERHEAD == EPROM_BLOCK_HEADER_LEN + 1, "EPROM_BLOCK_OVERHEAD doesn't match the block format");
+
 //#!*******************************************************************************************
-boolean Configurator::atBlockStart(int location) {
-	boolean rc = false;
+BlockScanner::BlockScanner(Configurator* configurator, int startPos)
+{
+	m_configurator = configurator;
+	m_currPos = startPos;
+	m_chunkStart = 0;
+	m_chunkLen = 0;
+}
+
+//#!*******************************************************************************************
+void BlockScanner::ensureInChunk(int location, int numBytes)
+{
+	if (location >= m_chunkStart && location + numBytes <= m_chunkStart + m_chunkLen) {
+		return;
+	}
 
-	if (EEPROM.read(location + 0) == EPROM_BLOCK_START_MAGIC_STRING[0] &&
-		EEPROM.read(location + 1) == EPROM_BLOCK_START_MAGIC_STRING[1] &&
-		EEPROM.read(location + 2) == EPROM_BLOCK_START_MAGIC_STRING[2] &&
-		EEPROM.read(location + 3) == EPROM_BLOCK_START_MAGIC_STRING[3]) 
-	{
-		rc = true;
+	// refill the chunk starting at the requested location
+	m_chunkStart = location;
+	m_chunkLen = EPROM_CONFIG_END - location;
+	if (m_chunkLen > EPROM_SCAN_CHUNK_SIZE) {
+		m_chunkLen = EPROM_SCAN_CHUNK_SIZE;
 	}
 
-	return rc;
+	m_configurator->readBytesFromEEPROM(m_chunkStart, m_chunkLen, m_chunk, NULL);
 }
 
 //#!*******************************************************************************************
-boolean Configurator::checkBlockTagMatches(int location, const char* tag) 
+unsigned char BlockScanner::byteAt(int location)
 {
-	boolean rc = false;
+	ensureInChunk(location, 1);
+	return m_chunk[location - m_chunkStart];
+}
 
-	if (EEPROM.read(location + 0) == tag[0] &&
-		EEPROM.read(location + 1) == tag[1] &&
-		EEPROM.read(location + 2) == tag[2] &&
-		EEPROM.read(location + 3) == tag[3])
-	{
-		rc = true;
+//#!*******************************************************************************************
+// Horspool shift for the byte found under the last position of the magic string
+int BlockScanner::magicShift(unsigned char byte)
+{
+	for (int i = EPROM_BLOCK_START_MAGIC_STRING_LEN - 2; i >= 0; i--) {
+		if (EPROM_BLOCK_START_MAGIC_STRING[i] == byte) {
+			return EPROM_BLOCK_START_MAGIC_STRING_LEN - 1 - i;
+		}
 	}
 
-	return rc;
+	return EPROM_BLOCK_START_MAGIC_STRING_LEN;
 }
 
 //#!*******************************************************************************************
-int Configurator::locateBlock(const char* tag, int startPos=0)
+boolean BlockScanner::readCandidate(int location, BlockInfo& info)
 {
-	int rc;
-	boolean blockFound = false;
-	int blockLocation = 0;
+	int currReadPos = location + EPROM_BLOCK_START_MAGIC_STRING_LEN;
 
-	int currLocation = startPos;
+	boolean legacy = (byteAt(location + EPROM_MAGIC_LAST_BYTE) == EPROM_LEGACY_BLOCK_START_MAGIC_STRING[EPROM_MAGIC_LAST_BYTE]);
+	info.headerLen = legacy ? EPROM_LEGACY_BLOCK_HEADER_LEN : EPROM_BLOCK_HEADER_LEN;
 
-	while ((blockFound!=true) && (currLocation<EPROM_CONFIG_END)) {		
-		
-		// are we at the start of a block
-		if (atBlockStart(currLocation) == true) {
-			
-			// check block tag matches if one was passed
-			if (tag!=NULL) {
-				int tagPos = currLocation + EPROM_BLOCK_START_MAGIC_STRING_LEN;		
-				if (checkBlockTagMatches(tagPos, tag) == true) {
-					blockFound = true;
-				}
-			}
-			else {
-				blockFound = true;
-			}
+	// header must fit in the config region
+	if (location + info.headerLen > EPROM_CONFIG_END) {
+		return false;
+	}
 
-			if (blockFound==true) {
-				blockLocation = currLocation;
-				break;
+	unsigned char crc = 0;
+
+	// tag
+	for (int i = 0; i < EPROM_TAG_SIZE; i++) {
+		info.tag[i] = (char) byteAt(currReadPos++);
+		m_configurator->crc8(&crc, (unsigned char) info.tag[i]);
+	}
+
+	// data len
+	unsigned char blockDataLenChar = byteAt(currReadPos++);
+	m_configurator->crc8(&crc, blockDataLenChar);
+
+	info.fingerprint = EPROM_FINGERPRINT_NONE;
+	info.version = 0;
+
+	if (legacy != true) {
+		// fingerprint
+		unsigned char fingerprintLo = byteAt(currReadPos++);
+		unsigned char fingerprintHi = byteAt(currReadPos++);
+		m_configurator->crc8(&crc, fingerprintLo);
+		m_configurator->crc8(&crc, fingerprintHi);
+
+		info.fingerprint = ((unsigned int) fingerprintHi << 8) | fingerprintLo;
+
+		// schema version
+		info.version = byteAt(currReadPos++);
+		m_configurator->crc8(&crc, info.version);
+	}
+
+	info.location = location;
+	info.dataLen = (int) blockDataLenChar;
+	info.blockLen = info.headerLen + info.dataLen + 1;
+	info.crcOk = false;
+
+	// block runs off the end of the region so can't be valid
+	if (location + info.blockLen > EPROM_CONFIG_END) {
+		return true;
+	}
+
+	// data
+	for (int i = 0; i < info.dataLen; i++) {
+		m_configurator->crc8(&crc, byteAt(currReadPos++));
+	}
+
+	// checksum
+	info.crcOk = (byteAt(currReadPos) == crc);
+
+	return true;
+}
+
+//#!*******************************************************************************************
+boolean BlockScanner::next(BlockInfo& info)
+{
+	const int lastMagicByte = EPROM_MAGIC_LAST_BYTE;
+
+	while (m_currPos + EPROM_BLOCK_START_MAGIC_STRING_LEN <= EPROM_CONFIG_END) {
+		ensureInChunk(m_currPos, EPROM_BLOCK_START_MAGIC_STRING_LEN);
+		const unsigned char* window = &m_chunk[m_currPos - m_chunkStart];
+
+		// compare the last byte first as it decides the skip distance
+		if ((window[lastMagicByte] == EPROM_BLOCK_START_MAGIC_STRING[lastMagicByte] ||
+			 window[lastMagicByte] == EPROM_LEGACY_BLOCK_START_MAGIC_STRING[lastMagicByte]) &&
+			memcmp(window, EPROM_BLOCK_START_MAGIC_STRING, lastMagicByte) == 0)
+		{
+			int candidatePos = m_currPos;
+
+			if (readCandidate(candidatePos, info) == true) {
+				// skip valid blocks whole but only step past the magic string of corrupt ones
+				// so that any block hidden behind a bad length is still found
+				m_currPos = info.crcOk ? candidatePos + info.blockLen : candidatePos + EPROM_BLOCK_START_MAGIC_STRING_LEN;
+				return true;
 			}
+
+			m_currPos = candidatePos + EPROM_BLOCK_START_MAGIC_STRING_LEN;
 		}
-		
-		currLocation++;		
-	}	
+		else {
+			m_currPos += magicShift(window[lastMagicByte]);
+		}
+	}
 
-	rc = blockFound ? blockLocation: -1;
+	return false;
+}
 
-	return rc;
+//#!*******************************************************************************************
+int Configurator::locateBlock(const char* tag, int startPos=0)
+{
+	BlockScanner scanner(this, startPos);
+	BlockInfo info;
+
+	while (scanner.next(info) == true) {
+		// corrupt blocks are ignored, as they are when choosing where to store blocks
+		if (info.crcOk != true) continue;
+
+		// check block tag matches if one was passed
+		if (tag == NULL || memcmp(info.tag, tag, EPROM_TAG_SIZE) == 0) {
+			return info.location;
+		}
+	}
+
+	return -1;
 }
 
 //#!*******************************************************************************************
@@ -190,16 +329,23 @@ int Configurator::writeByteToEEPROM(int location, int numBytes, char byte)
 	for (unsigned int t = 0; t<numBytes; t++) {
 		EEPROM.write(location + t, byte);
 	}
+
+	return location + numBytes;
 }
 
 //#!*******************************************************************************************
-int Configurator::writeBlockToEEPROM(const char* tag, const unsigned char* buffer, int bufferLen, int& blockStartPos, int& blockLen)
+int Configurator::writeBlockToEEPROM(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint, int& blockStartPos, int& blockLen)
 {
 	if (strlen(tag) < EPROM_TAG_SIZE) {
 		log(F("ERROR - Write aborted: tag size incorrect"));
 		return -1;
 	}
 
+	if (bufferLen > EPROM_MAX_BLOCK_DATA_LEN) {
+		log(F("ERROR - Write aborted: data too long for block"));
+		return -1;
+	}
+
 	int _blockStart = 0;
 
 	// find the block if writePos was not set
@@ -240,6 +386,14 @@ int Configurator::writeBlockToEEPROM(const char* tag, const unsigned char* buffe
 	unsigned char blockDataLenChar = (char) bufferLen;
 	currWritePos = writeBytesToEEPROM(currWritePos, &blockDataLenChar, 1, &crc);
 
+	// fingerprint
+	unsigned char fingerprintChars[2] = { (unsigned char) (fingerprint & 0xFF), (unsigned char) (fingerprint >> 8) };
+	currWritePos = writeBytesToEEPROM(currWritePos, fingerprintChars, 2, &crc);
+
+	// schema version
+	unsigned char versionChar = schemaVersion(tag);
+	currWritePos = writeBytesToEEPROM(currWritePos, &versionChar, 1, &crc);
+
 	// data
 	currWritePos = writeBytesToEEPROM(currWritePos, buffer, bufferLen, &crc);
 
@@ -267,7 +421,7 @@ int Configurator::readBytesFromEEPROM(int location, int numBytes, unsigned char*
 }
 
 //#!*******************************************************************************************
-int Configurator::readBlockAtPosFromEEPROM(int blockLocation, unsigned char* buffer, int bufferLen, int& bytesRead, int& blockLen, char* tag=NULL)
+int Configurator::readBlockAtPosFromEEPROM(int blockLocation, unsigned char* buffer, int bufferLen, unsigned int fingerprint, int& bytesRead, int& blockLen, char* tag=NULL)
 {
 	int currReadPos = blockLocation;
 
@@ -293,10 +447,53 @@ int Configurator::readBlockAtPosFromEEPROM(int blockLocation, unsigned char* buf
 	currReadPos = readBytesFromEEPROM(currReadPos, 1, (unsigned char*)&blockDataLenChar, &crc);
 	int blockDataLen = (int) blockDataLenChar;
 
-	// data
-	currReadPos = readBytesFromEEPROM(currReadPos, blockDataLen, buffer, &crc);
+	if (blockDataLen > bufferLen) {
+		log(F("ERROR - Block read error: block larger than buffer"));
+		return -1;
+	}
+
+	// legacy blocks have no layout id and are schema version 0
+	unsigned int blockFingerprint = EPROM_FINGERPRINT_NONE;
+	unsigned char blockVersion = 0;
+
+	if (blockStartStr[EPROM_MAGIC_LAST_BYTE] != EPROM_LEGACY_BLOCK_START_MAGIC_STRING[EPROM_MAGIC_LAST_BYTE]) {
+		// fingerprint
+		unsigned char fingerprintChars[2];
+		currReadPos = readBytesFromEEPROM(currReadPos, 2, fingerprintChars, &crc);
+		blockFingerprint = ((unsigned int) fingerprintChars[1] << 8) | fingerprintChars[0];
+
+		// schema version
+		currReadPos = readBytesFromEEPROM(currReadPos, 1, &blockVersion, &crc);
+	}
+
+	const ConfigSchema* schema = findSchema(_tag);
+	unsigned char currentVersion = (schema != NULL) ? schema->version : 0;
+
+	if (blockVersion > currentVersion) {
+		log(F("ERROR - Block read error: schema version [%d] is newer than [%d]"), blockVersion, currentVersion);
+		return -1;
+	}
+
+	// older versions are migrated so their layout is expected to differ, and blocks without a
+	// layout id can only be checked by their length
+	if (blockVersion == currentVersion && fingerprint != EPROM_FINGERPRINT_NONE &&
+		blockFingerprint != EPROM_FINGERPRINT_NONE && blockFingerprint != fingerprint) {
+		log(F("ERROR - Block read error: layout id mismatch"));
+		return -1;
+	}
+
+	// typed loads need the whole config, a shorter block would leave the rest of it at its defaults
+	if (blockVersion == currentVersion && fingerprint != EPROM_FINGERPRINT_NONE && blockDataLen != bufferLen) {
+		log(F("ERROR - Block read error: block is the wrong size"));
+		return -1;
+	}
+
+	// checksum the data before any of it is read into buffer, so a corrupt block leaves buffer untouched
+	int dataPos = currReadPos;
+	for (int t = 0; t < blockDataLen; t++) {
+		crc8(&crc, EEPROM.read(currReadPos++));
+	}
 
-	// checksum
 	unsigned char blockChecksumChar;
 	currReadPos = readBytesFromEEPROM(currReadPos, 1, (unsigned char*) &blockChecksumChar, NULL);
 
@@ -308,17 +505,220 @@ int Configurator::readBlockAtPosFromEEPROM(int blockLocation, unsigned char* buf
 	blockLen = currReadPos - blockLocation;
 	bytesRead = blockDataLen;
 
-	return 0;
+	if (blockVersion == currentVersion) {
+		readBytesFromEEPROM(dataPos, blockDataLen, buffer, NULL);
+		return 0;
+	}
+
+	// Older blocks are upgraded in a copy. Read straight into buffer, the old data would replace its
+	// contents before a migration had the chance to reject it, so a failed upgrade couldn't leave the
+	// defaults behind. Only the one-off upgrade of an older block pays for the copy.
+	unsigned char staged[bufferLen];
+	readBytesFromEEPROM(dataPos, blockDataLen, staged, NULL);
+
+	// upgrade the image one version at a time
+	for (unsigned char version = blockVersion; version < currentVersion; version++) {
+		if (schema->migrations[version](staged, bytesRead, bufferLen) != true || bytesRead > bufferLen) {
+			log(F("ERROR - Block read error: migration from schema version [%d] failed"), version);
+			return -1;
+		}
+	}
+
+	if (fingerprint != EPROM_FINGERPRINT_NONE && bytesRead != bufferLen) {
+		log(F("ERROR - Block read error: migrated block is the wrong size"));
+		return -1;
+	}
+
+	memcpy(buffer, staged, bytesRead);
+
+	log(F("Block upgraded from schema version [%d] to [%d]"), blockVersion, currentVersion);
+
+	return EPROM_BLOCK_MIGRATED;
 }
 
 //#!*******************************************************************************************
-int Configurator::readBlockFromEEPROM(const char* tag, unsigned char* buffer, int bufferLen, int& bytesRead, int& blockStartPos, int& blockLen)
+int Configurator::readBlockFromEEPROM(const char* tag, unsigned char* buffer, int bufferLen, unsigned int fingerprint, int& bytesRead, int& blockStartPos, int& blockLen)
 {
 	// find the block
 	blockStartPos = locateBlock(tag);
 	if (blockStartPos<0)  return -1;
 
-	return readBlockAtPosFromEEPROM(blockStartPos, buffer, bufferLen, bytesRead, blockLen);
+	return readBlockAtPosFromEEPROM(blockStartPos, buffer, bufferLen, fingerprint, bytesRead, blockLen);
+}
+
+//#!*******************************************************************************************
+boolean Configurator::registerSchema(const char* tag, unsigned char version, const ConfigMigration* migrations)
+{
+	if (strlen(tag) < EPROM_TAG_SIZE || (version > 0 && migrations == NULL)) {
+		log(F("ERROR - Schema not registered: tag size incorrect or no migrations"));
+		return false;
+	}
+
+	ConfigSchema* schema = (ConfigSchema*) findSchema(tag);
+
+	if (schema == NULL) {
+		if (m_numSchemas >= EPROM_MAX_SCHEMAS) {
+			log(F("ERROR - Schema not registered: too many schemas"));
+			return false;
+		}
+		schema = &m_schemas[m_numSchemas++];
+		memcpy(schema->tag, tag, EPROM_TAG_SIZE);
+	}
+
+	schema->version = version;
+	schema->migrations = migrations;
+
+	return true;
+}
+
+//#!*******************************************************************************************
+const ConfigSchema* Configurator::findSchema(const char* tag)
+{
+	for (int i = 0; i < m_numSchemas; i++) {
+		if (memcmp(m_schemas[i].tag, tag, EPROM_TAG_SIZE) == 0) {
+			return &m_schemas[i];
+		}
+	}
+
+	return NULL;
+}
+
+//#!*******************************************************************************************
+unsigned char Configurator::schemaVersion(const char* tag)
+{
+	const ConfigSchema* schema = findSchema(tag);
+	return (schema != NULL) ? schema->version : 0;
+}
+
+//#!*******************************************************************************************
+// Decides where a block for tag of newBlockLen bytes should be written. It is rewritten in place
+// if the existing block is the same length, otherwise it goes in the first gap large enough to
+// hold it and oldBlockPos is set to the existing block which must be retired once written, or -1
+// if there is none.
+// The existing block is left in place until the new copy is complete, so a reset part way through
+// the write still leaves a valid block behind. Only when no gap is large enough is the new block
+// written over the old one, provided it fits before the next block; a reset during that write
+// loses the block.
+int Configurator::planBlockWrite(const char* tag, int newBlockLen, int& oldBlockPos)
+{
+	int blockStartPos = -1;
+	int prevBlockEnd = EPROM_CONFIG_START;
+	int oldBlockRoom = -1;
+
+	oldBlockPos = -1;
+
+	BlockScanner scanner(this, EPROM_CONFIG_START);
+	BlockInfo info;
+
+	while (scanner.next(info) == true) {
+		// corrupt blocks are treated as free space
+		if (info.crcOk != true) continue;
+
+		// space from the old block up to the one following it, for the last resort rewrite in place
+		if (oldBlockPos >= 0 && oldBlockRoom < 0) {
+			oldBlockRoom = info.location - oldBlockPos;
+		}
+
+		if (memcmp(info.tag, tag, EPROM_TAG_SIZE) == 0) {
+			if (info.blockLen == newBlockLen) {
+				blockStartPos = info.location;
+				break;
+			}
+
+			// size has changed so the new copy goes elsewhere and the old one is retired afterwards
+			oldBlockPos = info.location;
+			oldBlockRoom = -1;
+		}
+
+		if (blockStartPos < 0 && info.location - prevBlockEnd >= newBlockLen) {
+			blockStartPos = prevBlockEnd;
+		}
+		prevBlockEnd = info.location + info.blockLen;
+	}
+
+	if (blockStartPos < 0 && EPROM_CONFIG_END - prevBlockEnd >= newBlockLen) {
+		blockStartPos = prevBlockEnd;
+	}
+
+	if (blockStartPos < 0 && oldBlockPos >= 0) {
+		if (oldBlockRoom < 0) {
+			oldBlockRoom = EPROM_CONFIG_END - oldBlockPos;
+		}
+		if (oldBlockRoom >= newBlockLen) {
+			log(F("WARNING - No free space for block, rewriting it in place"));
+			blockStartPos = oldBlockPos;
+		}
+	}
+
+	if (blockStartPos < 0) {
+		log(F("ERROR - Write aborted: no space for block"));
+	}
+
+	// nothing to retire if the new block will overwrite the old magic string
+	if (oldBlockPos >= 0 && blockStartPos >= 0 &&
+	    oldBlockPos + EPROM_BLOCK_START_MAGIC_STRING_LEN > blockStartPos && oldBlockPos < blockStartPos + newBlockLen) {
+		oldBlockPos = -1;
+	}
+
+	return blockStartPos;
+}
+
+//#!*******************************************************************************************
+void Configurator::retireBlock(int oldBlockPos)
+{
+	if (oldBlockPos >= 0) {
+		writeByteToEEPROM(oldBlockPos, EPROM_BLOCK_START_MAGIC_STRING_LEN, 'X');
+	}
+}
+
+//#!*******************************************************************************************
+int Configurator::storeBlock(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint)
+{
+	int oldBlockPos;
+	int blockStartPos = planBlockWrite(tag, EPROM_BLOCK_HEADER_LEN + bufferLen + 1, oldBlockPos);
+
+	if (blockStartPos < 0) {
+		return -1;
+	}
+
+	int blockLen;
+	if (writeBlockToEEPROM(tag, buffer, bufferLen, fingerprint, blockStartPos, blockLen) != 0) {
+		return -1;
+	}
+
+	retireBlock(oldBlockPos);
+
+	return 0;
+}
+
+//#!*******************************************************************************************
+// Builds the complete EEPROM image of a block so that it can be written later
+int Configurator::buildBlockImage(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint, unsigned char* image, unsigned char& crc)
+{
+	int pos = 0;
+	crc = 0;
+
+	memcpy(&image[pos], EPROM_BLOCK_START_MAGIC_STRING, EPROM_BLOCK_START_MAGIC_STRING_LEN);
+	pos += EPROM_BLOCK_START_MAGIC_STRING_LEN;
+
+	memcpy(&image[pos], tag, EPROM_TAG_SIZE);
+	crc8_buffer(&crc, &image[pos], EPROM_TAG_SIZE);
+	pos += EPROM_TAG_SIZE;
+
+	image[pos] = (unsigned char) bufferLen;
+	image[pos + 1] = (unsigned char) (fingerprint & 0xFF);
+	image[pos + 2] = (unsigned char) (fingerprint >> 8);
+	image[pos + 3] = schemaVersion(tag);
+	crc8_buffer(&crc, &image[pos], 4);
+	pos += 4;
+
+	memcpy(&image[pos], buffer, bufferLen);
+	crc8_buffer(&crc, &image[pos], bufferLen);
+	pos += bufferLen;
+
+	image[pos++] = crc;
+
+	return pos;
 }
 
 //#!*******************************************************************************************
@@ -335,39 +735,40 @@ void Configurator::dumpBytesFromEEPROMToConsole(int location, int numBytes)
 //#!*******************************************************************************************
 void Configurator::dumpBlocksToConsole(int startPos)
 {
-	int currPos = startPos;
-	while (currPos<EPROM_CONFIG_END) {
-		int blockFoundPos = locateBlock(NULL, currPos);
+	BlockScanner scanner(this, startPos);
+	BlockInfo info;
 
-		if (blockFoundPos>=0) {
-			unsigned char buffer[64];
-			int blockLen;
-			char tag[4];
-			int numBytesRead;
-			int rc = readBlockAtPosFromEEPROM(blockFoundPos, (unsigned char*)&buffer, 64, numBytesRead, blockLen, &tag[0]);
+	while (scanner.next(info) == true) {
+		String logMsg = "Block with tag [";
+		for (int i=0; i<EPROM_TAG_SIZE;i++) {
+			logMsg += info.tag[i];
+		}
+		
+		logMsg += "] found at location [";
+		logMsg += info.location;
 
-			String logMsg = "Block with tag [";
-			for (int i=0; i<4;i++) {
-				logMsg += tag[i];
-			}
-			
-			logMsg += "] found at location [";
-			logMsg += blockFoundPos;
+		logMsg += "] length [";
+		logMsg += info.blockLen;
 
-			logMsg += "] length [";
-			logMsg += blockLen;
+		logMsg += "] layout [";
+		logMsg += String(info.fingerprint, HEX);
 
-			logMsg += "] with contents [";
-			for (int i = 0; i<numBytesRead;i++)
-				logMsg += String(buffer[i], HEX);
-			logMsg += "]";
+		logMsg += "] version [";
+		logMsg += (int) info.version;
 
-			Serial.println(logMsg);
+		logMsg += info.crcOk ? "] checksum [OK" : "] checksum [BAD";
 
-			currPos+=blockLen+1;
-		} else {
-			currPos++;
+		logMsg += "] with contents [";
+		int dataPos = info.location + info.headerLen;
+		int dataEnd = dataPos + info.dataLen;
+		if (dataEnd > EPROM_CONFIG_END) {
+			dataEnd = EPROM_CONFIG_END;
 		}
+		for (int i = dataPos; i<dataEnd;i++)
+			logMsg += String(EEPROM.read(i), HEX);
+		logMsg += "]";
+
+		Serial.println(logMsg);
 	}
 }
 
@@ -392,18 +793,26 @@ void Configurator::printConfigCommandHelp(void(*printConfigItemHelp)(Configurato
 	log(F("E       = Erase all config in EEPROM"));
 	log(F("C       = Dump all config blocks to console"));
 	log(F("D:P,N   = Dump N bytes from EEPROM at pos P to console"));
+	log(F("B:N     = Skip config window at startup (N=1) or not (N=0)"));
 	log(F("Q       = Quit"));
 
 	log(F("---------------------------------------------"));
 }
 
 //#!*******************************************************************************************
-void Configurator::writeConfigToEEPROM(const char* tag, const unsigned char* config, int configLen, int _blockStartPos = -1) {
+void Configurator::writeConfigToEEPROM(const char* tag, const unsigned char* config, int configLen, unsigned int fingerprint, int _blockStartPos = -1) {
 	log(F("Writing config to EEPROM"));
 
-	int blockStartPos = _blockStartPos;
-	int blockLen;
-	int rc = writeBlockToEEPROM(tag, (const unsigned char*) config, configLen, blockStartPos, blockLen);
+	int rc;
+
+	if (_blockStartPos < 0) {
+		rc = storeBlock(tag, config, configLen, fingerprint);
+	}
+	else {
+		int blockStartPos = _blockStartPos;
+		int blockLen;
+		rc = writeBlockToEEPROM(tag, (const unsigned char*) config, configLen, fingerprint, blockStartPos, blockLen);
+	}
 
 	if (rc<0) {
 		log(F("Failed to write config to EEPROM"));
@@ -414,14 +823,26 @@ void Configurator::writeConfigToEEPROM(const char* tag, const unsigned char* con
 }
 
 //#!*******************************************************************************************
-void Configurator::loadConfigFromEEPROM(const char* tag, unsigned char* config, int configLen) {
+void Configurator::loadConfigFromEEPROM(const char* tag, unsigned char* config, int configLen, unsigned int fingerprint) {
 	log(F("Reading config from EEPROM."));
 
 	int numBytesRead, blockStartPos, blockLen;
 
-	if (readBlockFromEEPROM(tag, config, configLen, numBytesRead, blockStartPos, blockLen) == 0) {
+	// the config is only changed once the block is known to be good, so it keeps its defaults otherwise
+	int rc = readBlockFromEEPROM(tag, config, configLen, fingerprint, numBytesRead, blockStartPos, blockLen);
+
+	if (rc == 0) {
 		log(F("Successfully read config from EEPROM."));
 	}
+	else if (rc == EPROM_BLOCK_MIGRATED) {
+		// write the upgraded config back so it only needs migrating once
+		if (storeBlock(tag, config, numBytesRead, fingerprint) == 0) {
+			log(F("Successfully read and upgraded config in EEPROM."));
+		}
+		else {
+			log(F("Read config from EEPROM but failed to store upgraded config."));
+		}
+	}
 	else {
 		log(F("Failed to read config from EEPROM. Using default config."));
 	};
@@ -431,6 +852,7 @@ void Configurator::loadConfigFromEEPROM(const char* tag, unsigned char* config,
 void Configurator::runConfigUI(const char* configTag,
 	unsigned char* config,
 	int configLen,
+	unsigned int fingerprint,
 	void(*printConfigItemHelp)(Configurator*),
 	void(*printConfig)(Configurator*),
 	void(*setConfigItem)(Configurator*,const char*, const char*))
@@ -496,22 +918,26 @@ void Configurator::runConfigUI(const char* configTag,
 
 			// ** WRITE *************************************************************	
 			else if (lineBuffer[0] == 'W') {
-				char *posStr = strtok(lineBuffer, ",");
+				strtok(lineBuffer, ":");
+				char *posStr = strtok(NULL, ",");
 
-				if (strcmp(posStr,"")==0) {
-					writeConfigToEEPROM(configTag, config, configLen, -1);
+				// without a position the block is placed so that it doesn't overwrite other blocks
+				if (posStr == NULL || strcmp(posStr,"")==0) {
+					writeConfigToEEPROM(configTag, config, configLen, fingerprint, -1);
 				}
 				else {
                     int pos;
                     pos = atoi(posStr);
-					writeConfigToEEPROM(configTag, config, configLen, pos);
+					writeConfigToEEPROM(configTag, config, configLen, fingerprint, pos);
 				}
                 strcpy(lineBuffer, "");
             }
 
 			// ** READ *************************************************************	
 			else if (lineBuffer[0] == 'R') {
-				loadConfigFromEEPROM(configTag, config, configLen);
+				beginConfigUpdate();
+				loadConfigFromEEPROM(configTag, config, configLen, fingerprint);
+				endConfigUpdate();
                 strcpy(lineBuffer, "");
             }
 
@@ -523,7 +949,28 @@ void Configurator::runConfigUI(const char* configTag,
 
 				log(F("Setting item [%s] to [%s]"), key, val);
 
+				beginConfigUpdate();
 				setConfigItem(this, key, val);
+				endConfigUpdate();
+
+                strcpy(lineBuffer, "");
+            }
+
+			// ** BOOT **************************************************************	
+			else if (lineBuffer[0] == 'B') {
+                strtok(lineBuffer, ":");
+                char* flagStr = strtok(NULL, ",");
+
+				ConfiguratorSettings settings;
+				loadSettings(settings);
+				settings.skipConfigWindow = (flagStr != NULL && atoi(flagStr) != 0) ? 1 : 0;
+
+				if (store(EPROM_SETTINGS_TAG, settings)) {
+					log(F("Skip config window set to [%d]"), settings.skipConfigWindow);
+				}
+				else {
+					log(F("Failed to write settings to EEPROM"));
+				}
 
                 strcpy(lineBuffer, "");
             }
@@ -545,48 +992,336 @@ void Configurator::initConfig(  const char* configTag,
                                 void(*printConfig)(Configurator*),
                                 void(*setConfigItem)(Configurator*, const char*, const char*))
 {
-	int  initCycleDelay = 500;   // cycle time in ms
-	long initPeriodCountMax = m_configSelectPeriod / initCycleDelay;
-	long initPeriodCountCur = 0;
+	initConfigBlock(configTag, config, configLen, EPROM_FINGERPRINT_NONE, printConfigItemHelp, printConfig, setConfigItem);
+}
+
+//#!*******************************************************************************************
+void Configurator::setWakePin(int pin)
+{
+	m_wakePin = pin;
+	if (m_wakePin >= 0) {
+		pinMode(m_wakePin, INPUT_PULLUP);
+	}
+}
+
+//#!*******************************************************************************************
+boolean Configurator::loadSettings(ConfiguratorSettings& settings)
+{
+	settings.skipConfigWindow = 0;
+	return load(EPROM_SETTINGS_TAG, settings);
+}
+
+//#!*******************************************************************************************
+// The config window is still offered when skipping it if the wake pin is held low or a key
+// has already been received
+boolean Configurator::wakeRequested()
+{
+	if (m_wakePin >= 0 && digitalRead(m_wakePin) == LOW) {
+		return true;
+	}
+
+	return Serial.available() > 0;
+}
+
+//#!*******************************************************************************************
+void Configurator::initConfigBlock( const char* configTag,
+                                    unsigned char* config,
+                                    int configLen,
+                                    unsigned int fingerprint,
+                                    void(*printConfigItemHelp)(Configurator*),
+                                    void(*printConfig)(Configurator*),
+                                    void(*setConfigItem)(Configurator*, const char*, const char*))
+{
+	int  initPollDelay = 10;     // time in ms between checks for input
+	int  initDotPeriod = 500;    // time in ms between progress dots
 
 	char lineBuffer[32];
 
-	log(F("Starting up in [%d] ms"), m_configSelectPeriod);
+	ConfiguratorSettings settings;
+	boolean skipWindow = loadSettings(settings) && settings.skipConfigWindow != 0 && wakeRequested() != true;
+
+	if (skipWindow != true) {
+		log(F("Starting up in [%d] ms"), m_configSelectPeriod);
+	}
 	log(F("Using config"));
 
-	loadConfigFromEEPROM(configTag, config, configLen);
+	// publish the config to snapshot readers, the length first so it is valid once the pointer is seen
+	CONFIG_ATOMIC_STORE(&m_configLen, configLen, __ATOMIC_RELAXED);
+	CONFIG_ATOMIC_STORE(&m_config, config, __ATOMIC_RELEASE);
+
+	beginConfigUpdate();
+	loadConfigFromEEPROM(configTag, config, configLen, fingerprint);
+	endConfigUpdate();
+
 	printConfig(this);
 
+	if (skipWindow == true) {
+		log(F("Config window skipped"));
+		log(F("Continuing startup"));
+		return;
+	}
+
 	log(F("Press 'C' and 'Enter' to enter config mode or 'Q' to continue immediately"));
 
 	int configModeSelected = 0;
+	boolean quitSelected = false;
 
-	while ((initPeriodCountCur < initPeriodCountMax) && (configModeSelected == 0)) {
+	unsigned long windowStart = millis();
+	unsigned long lastDot = windowStart;
 
-		initPeriodCountCur++;
-		log(F("."));
-		delay(initCycleDelay);
+	while ((millis() - windowStart < (unsigned long) m_configSelectPeriod) && (configModeSelected == 0) && (quitSelected != true)) {
 
-        if (readLineFromSerial(Serial.read(), lineBuffer, sizeof(lineBuffer)) > 0) {
-			if (strcmp(lineBuffer,"C")==0) {
-				configModeSelected = 1;
+		// drain everything received so that a command is acted on at once and bursts don't overflow the UART buffer
+		while (Serial.available() > 0 && configModeSelected == 0 && quitSelected != true) {
+			if (readLineFromSerial(Serial.read(), lineBuffer, sizeof(lineBuffer)) > 0) {
+				if (strcmp(lineBuffer,"C")==0) {
+					configModeSelected = 1;
+				}
+				else if (strcmp(lineBuffer,"Q")==0) {
+					quitSelected = true;
+				}
 				strcpy(lineBuffer, "");
 			}
-			else if (strcmp(lineBuffer,"Q")==0) {
-				break;
-			}
+		}
+
+		if (millis() - lastDot >= (unsigned long) initDotPeriod) {
+			lastDot += initDotPeriod;
+			log(F("."));
+		}
+
+		if (configModeSelected == 0 && quitSelected != true) {
+			delay(initPollDelay);
 		}
 	}
 
 	if (configModeSelected == 1) {
 		log(F("Entering manual config mode"));
-		runConfigUI(configTag, config, configLen, printConfigItemHelp, printConfig, setConfigItem);
+		runConfigUI(configTag, config, configLen, fingerprint, printConfigItemHelp, printConfig, setConfigItem);
 	}
 
 	log(F("Continuing startup"));
 }
 
 
+//#!*******************************************************************************************
+// Background block writes
+//
+// Queued blocks are held as complete images packed one after another in m_buffer, oldest first.
+// Only the oldest block is ever being written. Its location is chosen when writing starts so that
+// it takes account of every block written before it.
+// *********************************************************************************************
+
+//#!*******************************************************************************************
+BlockWriteQueue::BlockWriteQueue(Configurator* configurator, unsigned char* buffer, int bufferLen)
+{
+	m_configurator = configurator;
+	m_numBlocks = 0;
+	m_buffer = buffer;
+	m_bufferLen = bufferLen;
+	m_bufferUsed = 0;
+}
+
+//#!*******************************************************************************************
+int BlockWriteQueue::findQueued(const char* tag, boolean notStarted)
+{
+	for (int i = 0; i < m_numBlocks; i++) {
+		if (notStarted == true && m_blocks[i].written > 0) continue;
+
+		if (memcmp(m_blocks[i].tag, tag, EPROM_TAG_SIZE) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+//#!*******************************************************************************************
+void BlockWriteQueue::removeQueued(int index, int rc)
+{
+	QueuedBlock removed = m_blocks[index];
+
+	int imageStart = 0;
+	for (int i = 0; i < index; i++) {
+		imageStart += m_blocks[i].imageLen;
+	}
+
+	memmove(&m_buffer[imageStart], &m_buffer[imageStart + removed.imageLen], m_bufferUsed - imageStart - removed.imageLen);
+	m_bufferUsed -= removed.imageLen;
+
+	for (int i = index; i < m_numBlocks - 1; i++) {
+		m_blocks[i] = m_blocks[i + 1];
+	}
+	m_numBlocks--;
+
+	if (removed.onComplete != NULL) {
+		char tag[EPROM_TAG_SIZE + 1];
+		memcpy(tag, removed.tag, EPROM_TAG_SIZE);
+		tag[EPROM_TAG_SIZE] = 0;
+		removed.onComplete(m_configurator, tag, rc, removed.crc);
+	}
+}
+
+//#!*******************************************************************************************
+int BlockWriteQueue::saveBlock(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint,
+                               void(*onComplete)(Configurator*, const char*, int, unsigned char))
+{
+	if (strlen(tag) < EPROM_TAG_SIZE) {
+		m_configurator->log(F("ERROR - Write aborted: tag size incorrect"));
+		return -1;
+	}
+
+	if (bufferLen > EPROM_MAX_BLOCK_DATA_LEN) {
+		m_configurator->log(F("ERROR - Write aborted: data too long for block"));
+		return -1;
+	}
+
+	// an earlier save of the same tag which hasn't started being written is superseded. One which
+	// is part way through is left to finish, so that a valid block is always left behind, and is
+	// then overwritten by this one.
+	int queued = findQueued(tag, true);
+	if (queued >= 0) {
+		removeQueued(queued, EPROM_WRITE_SUPERSEDED);
+	}
+
+	int imageLen = EPROM_BLOCK_HEADER_LEN + bufferLen + 1;
+
+	if (m_numBlocks >= EPROM_WRITE_QUEUE_BLOCKS || m_bufferUsed + imageLen > m_bufferLen) {
+		m_configurator->log(F("ERROR - Write aborted: write queue full"));
+		return -1;
+	}
+
+	QueuedBlock& block = m_blocks[m_numBlocks];
+	memcpy(block.tag, tag, EPROM_TAG_SIZE);
+	block.imageLen = m_configurator->buildBlockImage(tag, buffer, bufferLen, fingerprint, &m_buffer[m_bufferUsed], block.crc);
+	block.location = -1;
+	block.oldBlockPos = -1;
+	block.written = 0;
+	block.retired = 0;
+	block.onComplete = onComplete;
+
+	m_bufferUsed += block.imageLen;
+	m_numBlocks++;
+
+	return 0;
+}
+
+//#!*******************************************************************************************
+void BlockWriteQueue::poll()
+{
+	while (m_numBlocks > 0) {
+#ifdef __AVR__
+		// the previous byte is still being programmed. Checked before planning too, so a poll made
+		// while the EEPROM is busy doesn't scan it for nothing.
+		if (!eeprom_is_ready()) return;
+#endif
+		QueuedBlock& block = m_blocks[0];
+
+		if (block.location < 0) {
+			block.location = m_configurator->planBlockWrite(block.tag, block.imageLen, block.oldBlockPos);
+
+			if (block.location < 0) {
+				removeQueued(0, -1);
+				continue;
+			}
+		}
+
+		while (block.written < block.imageLen) {
+#ifdef __AVR__
+			if (!eeprom_is_ready()) return;
+#endif
+			int location = block.location + block.written;
+			unsigned char value = m_buffer[block.written];
+			block.written++;
+
+			// bytes which already hold the right value cost nothing
+			if (EEPROM.read(location) != value) {
+				EEPROM.write(location, value);
+			}
+		}
+
+		// the old copy is retired a byte at a time in the same way
+		while (block.oldBlockPos >= 0 && block.retired < EPROM_BLOCK_START_MAGIC_STRING_LEN) {
+#ifdef __AVR__
+			if (!eeprom_is_ready()) return;
+#endif
+			EEPROM.write(block.oldBlockPos + block.retired, 'X');
+			block.retired++;
+		}
+
+		removeQueued(0, 0);
+	}
+}
+
+//#!*******************************************************************************************
+boolean BlockWriteQueue::pending(const char* tag)
+{
+	return findQueued(tag, false) >= 0;
+}
+
+//#!*******************************************************************************************
+int BlockWriteQueue::numPending()
+{
+	return m_numBlocks;
+}
+
+//#!*******************************************************************************************
+// Config snapshots
+//
+// The config is guarded by a seqlock. The writer makes the sequence odd before changing the
+// config and even again afterwards; readers copy the config and keep the copy only if the
+// sequence was even and unchanged across the copy.
+// *********************************************************************************************
+
+//#!*******************************************************************************************
+void Configurator::beginConfigUpdate()
+{
+	unsigned int seq = CONFIG_ATOMIC_LOAD(&m_configSeq, __ATOMIC_RELAXED);
+	CONFIG_ATOMIC_STORE(&m_configSeq, seq + 1, __ATOMIC_RELAXED);
+
+	// config writes must not be seen before the sequence goes odd
+	CONFIG_ATOMIC_FENCE(__ATOMIC_RELEASE);
+}
+
+//#!*******************************************************************************************
+void Configurator::endConfigUpdate()
+{
+	unsigned int seq = CONFIG_ATOMIC_LOAD(&m_configSeq, __ATOMIC_RELAXED);
+	CONFIG_ATOMIC_STORE(&m_configSeq, seq + 1, __ATOMIC_RELEASE);
+}
+
+//#!*******************************************************************************************
+boolean Configurator::configRegistered(int configLen) const
+{
+	const unsigned char* config = CONFIG_ATOMIC_LOAD(&m_config, __ATOMIC_ACQUIRE);
+
+	return config != NULL && CONFIG_ATOMIC_LOAD(&m_configLen, __ATOMIC_RELAXED) == configLen;
+}
+
+//#!*******************************************************************************************
+boolean Configurator::readConfigSnapshot(unsigned char* buffer, int bufferLen) const
+{
+	const unsigned char* config = CONFIG_ATOMIC_LOAD(&m_config, __ATOMIC_ACQUIRE);
+
+	if (config == NULL || CONFIG_ATOMIC_LOAD(&m_configLen, __ATOMIC_RELAXED) != bufferLen) {
+		return false;
+	}
+
+	unsigned int seqBefore = CONFIG_ATOMIC_LOAD(&m_configSeq, __ATOMIC_ACQUIRE);
+	if (seqBefore & 1) {
+		return false;
+	}
+
+	for (int i = 0; i < bufferLen; i++) {
+		buffer[i] = CONFIG_ATOMIC_LOAD(&config[i], __ATOMIC_RELAXED);
+	}
+
+	// config reads must complete before the sequence is checked again
+	CONFIG_ATOMIC_FENCE(__ATOMIC_ACQUIRE);
+	unsigned int seqAfter = CONFIG_ATOMIC_LOAD(&m_configSeq, __ATOMIC_RELAXED);
+
+	return seqBefore == seqAfter;
+}
+
 //#!*******************************************************************************************
 void Configurator::logToStream(const char * fsh)
 {
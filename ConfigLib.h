@@ -30,9 +30,146 @@ Once complete they can exit and the sketch will continue loading.
 *****************************************************************************/
 
 #define EPROM_TAG_SIZE 4
+#define EPROM_SCAN_CHUNK_SIZE 32
+#define EPROM_MAX_BLOCK_DATA_LEN 255
+#define EPROM_FINGERPRINT_NONE 0
+
+// bytes a block takes in EEPROM on top of its data, for its header and checksum
+#define EPROM_BLOCK_OVERHEAD 13
+
+// number of blocks a BlockWriteQueue can hold
+#define EPROM_WRITE_QUEUE_BLOCKS 4
+
+// tag of the block holding the configurator's own settings
+#define EPROM_SETTINGS_TAG "CFGS"
+
+// number of tags which can have a schema registered
+#define EPROM_MAX_SCHEMAS 2
+
+// returned by block reads when the block was upgraded from an older schema version
+#define EPROM_BLOCK_MIGRATED 1
+
+// result passed to a BlockWriteQueue completion callback when a later save of the same tag replaced the block
+#define EPROM_WRITE_SUPERSEDED 1
+
+#if defined(__GNUC__) && (__GNUC__ >= 5)
+	#define CONFIGLIB_IS_TRIVIALLY_COPYABLE(T) __is_trivially_copyable(T)
+#else
+	#include <type_traits>
+	#define CONFIGLIB_IS_TRIVIALLY_COPYABLE(T) std::is_trivially_copyable<T>::value
+#endif
+
+/*
+    ConfigLayout
+    16 bit layout id of a config type, stored in the block header. Typed loads only accept blocks
+    whose layout id matches the one they were written with.
+    The default id is made from the size and alignment of the type only, so it will not catch fields
+    being reordered or changing type without changing the size. Specialise ConfigLayout for your
+    config type and change its id whenever the layout changes to have those caught too, e.g.
+        template<> struct ConfigLayout<Config> { static constexpr unsigned int id = 0x0102; };
+    The id must not be EPROM_FINGERPRINT_NONE.
+*/
+template<class T> struct ConfigLayout
+{
+    static constexpr unsigned int id = ((unsigned int) alignof(T) << 8) | (unsigned int) sizeof(T);
+};
+
+template<class T> constexpr unsigned int configLayoutId()
+{
+    return ConfigLayout<T>::id;
+}
+
+/*
+    ConfigCopier
+    Copies and compares config values a machine word at a time when the size and alignment
+    of the type allow it, otherwise falls back to a byte copy.
+*/
+typedef unsigned int __attribute__((__may_alias__)) ConfigWord;
+
+template<class T, bool WordSized = (sizeof(T) % sizeof(unsigned int) == 0) && (alignof(T) >= alignof(unsigned int))>
+struct ConfigCopier
+{
+    static void copy(void* dst, const void* src) { memcpy(dst, src, sizeof(T)); }
+    static boolean equal(const void* a, const void* b) { return memcmp(a, b, sizeof(T)) == 0; }
+};
+
+template<class T>
+struct ConfigCopier<T, true>
+{
+    static void copy(void* dst, const void* src)
+    {
+        ConfigWord* d = (ConfigWord*) dst;
+        const ConfigWord* s = (const ConfigWord*) src;
+        for (unsigned int i = 0; i < sizeof(T) / sizeof(ConfigWord); i++) {
+            d[i] = s[i];
+        }
+    }
+
+    static boolean equal(const void* a, const void* b)
+    {
+        const ConfigWord* wa = (const ConfigWord*) a;
+        const ConfigWord* wb = (const ConfigWord*) b;
+        for (unsigned int i = 0; i < sizeof(T) / sizeof(ConfigWord); i++) {
+            if (wa[i] != wb[i]) return false;
+        }
+        return true;
+    }
+};
+
+/*
+    BlockInfo
+    Describes a candidate block found while scanning the EEPROM.
+*/
+struct BlockInfo
+{
+    char tag[EPROM_TAG_SIZE];   // block tag
+    int location;               // position of the block magic string
+    int blockLen;               // length of the whole block including header and checksum
+    int dataLen;                // length of the data held in the block
+    unsigned int fingerprint;   // layout id of the data (see ConfigLayout) or EPROM_FINGERPRINT_NONE
+    unsigned char version;      // schema version of the data
+    int headerLen;              // length of the header, shorter for blocks in the legacy format
+    boolean crcOk;              // true if the stored checksum matches the block contents
+};
+
+/*
+    ConfiguratorSettings
+    Settings of the configurator itself, stored in the block tagged EPROM_SETTINGS_TAG.
+*/
+struct ConfiguratorSettings
+{
+    unsigned char skipConfigWindow;     // non zero to boot without waiting for the user, set with the B command
+};
+
+/*
+    ConfigMigration
+    Upgrades a block image from one schema version to the next, in place.
+    params:
+        image: the block data, which may grow up to bufferLen bytes
+        imageLen: length of the image, to be updated with the upgraded length
+        bufferLen: size of the buffer holding image
+    returns: false if the image could not be upgraded, in which case the block is not loaded and
+             the config keeps its defaults
+*/
+typedef boolean (*ConfigMigration)(unsigned char* image, int& imageLen, int bufferLen);
+
+/*
+    ConfigSchema
+    Current schema version of a tagged block and the migrations that bring older versions up to it.
+    migrations[v] upgrades an image from version v to version v+1.
+*/
+struct ConfigSchema
+{
+    char tag[EPROM_TAG_SIZE];
+    unsigned char version;
+    const ConfigMigration* migrations;
+};
 
 class Configurator 
 {
+    friend class BlockScanner;
+    friend class BlockWriteQueue;
+
     public:
         /* 
            Constructor
@@ -49,6 +186,8 @@ class Configurator
             Call to trigger the config process. 
             Any config stored in flash will be read into the config parameter.
             The user may then, within a default period, trigger the config process allowing them to modify the config and store to flash.
+            If the window has been set to be skipped with the B command it is only offered when the wake pin is held
+            or a key has already been received.
             params:
                 configTag: tag assigned to the block used to hold the config in flash
                 config: pointer to the config structure which will be loaded / modified
@@ -64,18 +203,161 @@ class Configurator
                     void(*printConfig)(Configurator*),
                     void(*setConfigItem)(Configurator*,const char*, const char*));    
 
+        /*
+            initConfig
+            Typed version of the above. The config is stored along with its layout id (see ConfigLayout)
+            and stored config written for a different layout is not loaded.
+        */
+        template<class T> void initConfig(const char* configTag,
+                    T& config,
+                    void(*printConfigItemHelp)(Configurator*),
+                    void(*printConfig)(Configurator*),
+                    void(*setConfigItem)(Configurator*,const char*, const char*))
+        {
+            checkConfigType<T>();
+            initConfigBlock(configTag, (unsigned char*) &config, sizeof(T), configLayoutId<T>(),
+                            printConfigItemHelp, printConfig, setConfigItem);
+        }
+
+        /*
+            load
+            Reads the block tagged with tag into value.
+            value is left untouched if the block is missing, corrupt or was stored for a different layout.
+            returns: true if value was loaded
+        */
+        template<class T> bool load(const char* tag, T& value)
+        {
+            checkConfigType<T>();
+
+            alignas(T) unsigned char staged[sizeof(T)];
+            int numBytesRead, blockStartPos, blockLen;
+
+            int rc = readBlockFromEEPROM(tag, staged, sizeof(T), configLayoutId<T>(), numBytesRead, blockStartPos, blockLen);
+            if (rc < 0 || numBytesRead != sizeof(T)) {
+                return false;
+            }
+
+            // write back blocks upgraded from an older schema so they only need migrating once
+            if (rc == EPROM_BLOCK_MIGRATED) {
+                storeBlock(tag, staged, sizeof(T), configLayoutId<T>());
+            }
+
+            ConfigCopier<T>::copy(&value, staged);
+            return true;
+        }
+
+        /*
+            store
+            Writes value to the block tagged with tag, creating or moving the block if needed.
+            Nothing is written if the stored block already holds the same value.
+            returns: true if the block holds value on return
+        */
+        template<class T> bool store(const char* tag, const T& value)
+        {
+            checkConfigType<T>();
+
+            alignas(T) unsigned char stored[sizeof(T)];
+            int numBytesRead, blockStartPos, blockLen;
+
+            if (readBlockFromEEPROM(tag, stored, sizeof(T), configLayoutId<T>(), numBytesRead, blockStartPos, blockLen) == 0 &&
+                numBytesRead == sizeof(T) && ConfigCopier<T>::equal(stored, &value)) {
+                return true;
+            }
+
+            return storeBlock(tag, (const unsigned char*) &value, sizeof(T), configLayoutId<T>()) == 0;
+        }
+
         /*
             Logs the string to the stream after using 
             printf to handle the string substitution of the varargs
         */
         void log(const __FlashStringHelper * fsh, ...);
 
+        /*
+            setWakePin
+            Sets a pin which, when held low at startup, opens the config window even if it has been
+            set to be skipped. The pin is configured as INPUT_PULLUP. Pass -1 to disable.
+        */
+        void setWakePin(int pin);
+
+        /*
+            registerSchema
+            Sets the current schema version of the block tagged with tag along with the migrations used to
+            upgrade older versions of it. Blocks are written with their current version and any block loaded
+            with an older version is upgraded in place and written back once. If a migration fails the
+            block is not loaded and the config keeps its defaults. Blocks saved by versions of the library
+            without schema versions are treated as version 0.
+            Call before initConfig or load for the tag.
+            params:
+                version: current schema version, blocks of unregistered tags are version 0
+                migrations: array of version entries where migrations[v] upgrades version v to v+1
+            returns: true if registered
+        */
+        boolean registerSchema(const char* tag, unsigned char version, const ConfigMigration* migrations);
+
+        /*
+            beginConfigUpdate / endConfigUpdate
+            The config passed to initConfig may be read by other tasks using snapshot while it is being
+            changed. Changes made by the config UI are already bracketed by these calls; wrap any change
+            the sketch makes itself in them too. Only one task may update the config at a time.
+        */
+        void beginConfigUpdate();
+        void endConfigUpdate();
+
+        /*
+            trySnapshot
+            Makes a single lock free attempt at copying the config passed to initConfig into copy.
+            returns: false if an update was in progress, in which case copy may be torn and should be discarded
+        */
+        template<class T> bool trySnapshot(T& copy) const
+        {
+            checkConfigType<T>();
+            return readConfigSnapshot((unsigned char*) &copy, sizeof(T));
+        }
+
+        /*
+            snapshot
+            Copies a consistent view of the config passed to initConfig into copy, retrying while an update is in progress.
+            Readers are lock free and never block the updating task, but they are not wait free: while an update is
+            in progress they wait for it in steps of delay(1). For the same reason snapshot must not be called from
+            an interrupt handler, as the update it is waiting for could then never complete; use trySnapshot there.
+            returns: false if no config of that size has been registered through initConfig
+        */
+        template<class T> bool snapshot(T& copy) const
+        {
+            checkConfigType<T>();
+            if (configRegistered(sizeof(T)) != true) return false;
+
+            while (readConfigSnapshot((unsigned char*) &copy, sizeof(T)) != true) {
+                // let a lower priority updating task finish
+                delay(1);
+            }
+            return true;
+        }
+
                     
     protected:
     
+        template<class T> static void checkConfigType()
+        {
+            static_assert(CONFIGLIB_IS_TRIVIALLY_COPYABLE(T), "Config types must be trivially copyable");
+            static_assert(sizeof(T) <= EPROM_MAX_BLOCK_DATA_LEN, "Config types must fit in a single block");
+            static_assert(configLayoutId<T>() != EPROM_FINGERPRINT_NONE && configLayoutId<T>() <= 0xFFFF,
+                          "Config layout ids must be non zero and fit in 16 bits");
+        }
+
+        void initConfigBlock(const char* configTag,
+                        unsigned char* config,
+                        int configLen,
+                        unsigned int fingerprint,
+                        void(*printConfigItemHelp)(Configurator*),
+                        void(*printConfig)(Configurator*),
+                        void(*setConfigItem)(Configurator*, const char*, const char*));
+
         void runConfigUI(const char* configTag,
                         unsigned char* config,
                         int configLen,
+                        unsigned int fingerprint,
                         void(*printConfigItemHelp)(Configurator*),
                         void(*printConfig)(Configurator*),
                         void(*setConfigItem)(Configurator*, const char*, const char*));
@@ -83,11 +365,29 @@ class Configurator
     	Stream* m_stream = NULL;
         int m_logBufferSize;
         int m_configSelectPeriod;
+        int m_wakePin = -1;
+
+        // config registered by initConfig and the seqlock sequence guarding it, odd while an update is in progress.
+        // m_config is published with release semantics so only ever access these through CONFIG_ATOMIC_LOAD/STORE
+        unsigned char* m_config = NULL;
+        int m_configLen = 0;
+        unsigned int m_configSeq = 0;
+
+        boolean configRegistered(int configLen) const;
+        boolean readConfigSnapshot(unsigned char* buffer, int bufferLen) const;
+
+        ConfigSchema m_schemas[EPROM_MAX_SCHEMAS];
+        int m_numSchemas = 0;
+
+        const ConfigSchema* findSchema(const char* tag);
+        unsigned char schemaVersion(const char* tag);
     
         void logToStream(const char* msg);
         
         void dumpBlocksToConsole(int startPos);
         void printConfigCommandHelp(void(*printConfigItemHelp)(Configurator*));
+        boolean loadSettings(ConfiguratorSettings& settings);
+        boolean wakeRequested();
 
         void sprintf_vargs(char* buffer, int bufferlen, char * format, ...);
         String getField(String* msg, char fieldSep) ;
@@ -95,23 +395,147 @@ class Configurator
         int readLineFromSerial(int readch, char*buffer, int bufferLen);
         char* find_first_non_white_space(const char *line);
 
-        boolean atBlockStart(int location);
-        boolean checkBlockTagMatches(int location, const char* tag) ;
         int locateBlock(const char* tag, int startPos);
         int writeBytesToEEPROM(int location, const unsigned char* buffer, int bufferLen, unsigned char* crc);
         int writeByteToEEPROM(int location, int numBytes, char byte);
-        int writeBlockToEEPROM(const char* tag, const unsigned char* buffer, int bufferLen, int& blockStartPos, int& blockLen);
+        int writeBlockToEEPROM(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint, int& blockStartPos, int& blockLen);
+        int storeBlock(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint);
+        int planBlockWrite(const char* tag, int newBlockLen, int& oldBlockPos);
+        void retireBlock(int oldBlockPos);
+        int buildBlockImage(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint, unsigned char* image, unsigned char& crc);
         int readBytesFromEEPROM(int location, int numBytes, unsigned char* buffer, unsigned char* crc);
-        int readBlockAtPosFromEEPROM(int blockLocation, unsigned char* buffer, int bufferLen, int& bytesRead, int& blockLen, char* tag);
-        int readBlockFromEEPROM(const char* tag, unsigned char* buffer, int bufferLen, int& bytesRead, int& blockStartPos, int& blockLen);
-        void writeConfigToEEPROM(const char* tag, const unsigned char* config, int configLen, int _blockStartPos);
-        void loadConfigFromEEPROM(const char* tag, unsigned char* config, int configLen);
+        int readBlockAtPosFromEEPROM(int blockLocation, unsigned char* buffer, int bufferLen, unsigned int fingerprint, int& bytesRead, int& blockLen, char* tag);
+        int readBlockFromEEPROM(const char* tag, unsigned char* buffer, int bufferLen, unsigned int fingerprint, int& bytesRead, int& blockStartPos, int& blockLen);
+        void writeConfigToEEPROM(const char* tag, const unsigned char* config, int configLen, unsigned int fingerprint, int _blockStartPos);
+        void loadConfigFromEEPROM(const char* tag, unsigned char* config, int configLen, unsigned int fingerprint);
         void dumpBytesFromEEPROMToConsole(int location, int numBytes);
         
         void crc8(unsigned char *crc, unsigned char m);
         void crc8_buffer(unsigned char *crc, const unsigned char *buffer, int bufferLen);
 
 };
+
+/*
+    BlockScanner
+    Walks the EEPROM config region in a single pass and yields every candidate block.
+    The region is read in chunks of EPROM_SCAN_CHUNK_SIZE bytes and the magic string is
+    located using a Horspool skip search so each byte is read from EEPROM about once.
+    Blocks whose checksum is valid are skipped over as a whole; corrupt candidates are
+    still reported so that they can be recovered or inspected.
+
+    Usage:
+        BlockScanner scanner(configurator, startPos);
+        BlockInfo info;
+        while (scanner.next(info)) { ... }
+*/
+class BlockScanner
+{
+    public:
+        BlockScanner(Configurator* configurator, int startPos);
+
+        /*
+            next
+            Moves on to the next candidate block.
+            returns: true and fills in info if a block was found, false once the end of the region is reached
+        */
+        boolean next(BlockInfo& info);
+
+    protected:
+        Configurator* m_configurator;
+        int m_currPos;
+        int m_chunkStart;
+        int m_chunkLen;
+        unsigned char m_chunk[EPROM_SCAN_CHUNK_SIZE];
+
+        void ensureInChunk(int location, int numBytes);
+        unsigned char byteAt(int location);
+        int magicShift(unsigned char byte);
+        boolean readCandidate(int location, BlockInfo& info);
+};
+
+/*
+    BlockWriteQueue
+    Saves blocks to EEPROM in the background. A save copies the block into the queue and returns
+    immediately; the bytes are then programmed by calls to poll, which should be made regularly
+    from loop(). On AVR poll only starts a byte once the EEPROM is ready for it so never waits the
+    ~3.3ms each byte takes to program.
+
+    Saving a tag which is already queued replaces the queued block and the earlier save completes
+    with EPROM_WRITE_SUPERSEDED. If the earlier block is already part way through being written it
+    is left to finish first, so a partly written block is never abandoned, and the new one follows it.
+
+    Usage:
+        static unsigned char writeQueueBuffer[256];
+        BlockWriteQueue writeQueue(&configurator, writeQueueBuffer, sizeof(writeQueueBuffer));
+        writeQueue.save(CONFIG_TAG, config, onSaved);
+        ...
+        void loop() { writeQueue.poll(); ... }
+*/
+class BlockWriteQueue
+{
+    public:
+        /*
+            params:
+              buffer: memory used to hold the queued block images, which must last as long as the queue.
+                      Each queued block takes its length + EPROM_BLOCK_OVERHEAD bytes.
+              bufferLen: size of buffer
+        */
+        BlockWriteQueue(Configurator* configurator, unsigned char* buffer, int bufferLen);
+
+        /*
+            save
+            Queues value to be written to the block tagged with tag.
+            params:
+                onComplete: optional callback made once the block is done with, with rc 0 if it was written,
+                            -1 on failure or EPROM_WRITE_SUPERSEDED, and the checksum of the block
+            returns: 0 if queued, -1 if the queue is full
+        */
+        template<class T> int save(const char* tag, const T& value,
+                                   void(*onComplete)(Configurator*, const char*, int, unsigned char) = NULL)
+        {
+            Configurator::checkConfigType<T>();
+            return saveBlock(tag, (const unsigned char*) &value, sizeof(T), configLayoutId<T>(), onComplete);
+        }
+
+        int saveBlock(const char* tag, const unsigned char* buffer, int bufferLen, unsigned int fingerprint,
+                      void(*onComplete)(Configurator*, const char*, int, unsigned char));
+
+        /*
+            poll
+            Programs as many queued bytes as the EEPROM is ready for and makes completion callbacks.
+        */
+        void poll();
+
+        /*
+            pending / numPending
+            Status of the queue: whether a block for tag is still to be written and how many blocks are.
+        */
+        boolean pending(const char* tag);
+        int numPending();
+
+    protected:
+        struct QueuedBlock
+        {
+            char tag[EPROM_TAG_SIZE];
+            int imageLen;           // length of the block image in m_buffer
+            int location;           // where the block is being written, -1 until writing starts
+            int oldBlockPos;        // previous copy of the block to retire once written
+            int written;            // number of image bytes written so far
+            int retired;            // number of bytes of the old copy's magic string overwritten so far
+            unsigned char crc;
+            void(*onComplete)(Configurator*, const char*, int, unsigned char);
+        };
+
+        Configurator* m_configurator;
+        QueuedBlock m_blocks[EPROM_WRITE_QUEUE_BLOCKS];
+        int m_numBlocks;
+        unsigned char* m_buffer;
+        int m_bufferLen;
+        int m_bufferUsed;
+
+        int findQueued(const char* tag, boolean notStarted);
+        void removeQueued(int index, int rc);
+};
                 
 #endif
 
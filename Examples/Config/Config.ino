@@ -59,7 +59,7 @@ void setup()
     // Init the config 
     // Tries to read config from block in EEPROM which is tagged with CONFIG_TAG
     // Will then use the callback functions to display the config and allow the user to modify it and save it if triggered during the 10s wait
-    configurator.initConfig(CONFIG_TAG, (unsigned char *) &config, sizeof(Config), printConfigItemHelp, printConfig, setConfigItem);
+    configurator.initConfig(CONFIG_TAG, config, printConfigItemHelp, printConfig, setConfigItem);
   
 	Serial.print(String(F("Setup complete\n")).c_str());
 }
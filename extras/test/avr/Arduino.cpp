@@ -0,0 +1,18 @@
+#include "Arduino.h"
+#include "EEPROM.h"
+
+Stream Serial;
+EEPROMClass EEPROM;
+
+static volatile unsigned long ticks = 0;
+
+unsigned long millis() { return ticks++; }
+void delay(unsigned long ms) { ticks += ms; }
+void pinMode(uint8_t pin, uint8_t mode) {}
+int digitalRead(uint8_t pin) { return HIGH; }
+
+int Stream::available() { return 0; }
+int Stream::read() { return -1; }
+void Stream::print(const char* s) {}
+void Stream::println(const char* s) {}
+void Stream::flush() {}
@@ -0,0 +1,88 @@
+// Arduino.h
+//
+// Minimal AVR stand-in for the parts of the Arduino core used by ConfigLib, used to check that
+// the library compiles and links with the AVR toolchain. Nothing built with it is ever run.
+
+#ifndef _ARDUINO_AVR_STUB_h
+#define _ARDUINO_AVR_STUB_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <avr/pgmspace.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(PSTR(s)))
+
+#define HEX 16
+#define LOW 0
+#define HIGH 1
+#define INPUT_PULLUP 2
+
+unsigned long millis();
+void delay(unsigned long ms);
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+
+class String
+{
+    public:
+        String(const char* s = "") { set(s); }
+        String(const __FlashStringHelper* s)
+        {
+            strncpy_P(m_buffer, (const char*) s, sizeof(m_buffer) - 1);
+            m_buffer[sizeof(m_buffer) - 1] = 0;
+        }
+        String(int value, int base = 10) { snprintf(m_buffer, sizeof(m_buffer), base == HEX ? "%x" : "%d", value); }
+
+        String& operator+=(const char* s) { strncat(m_buffer, s, sizeof(m_buffer) - 1 - strlen(m_buffer)); return *this; }
+        String& operator+=(char c) { char s[2] = { c, 0 }; return *this += s; }
+        String& operator+=(int value) { return *this += String(value).c_str(); }
+        String& operator+=(const String& s) { return *this += s.c_str(); }
+
+        const char* c_str() const { return m_buffer; }
+        unsigned int length() const { return strlen(m_buffer); }
+        int indexOf(char c) const { const char* p = strchr(m_buffer, c); return p == NULL ? -1 : (int) (p - m_buffer); }
+
+        String substring(int from, int to) const
+        {
+            String result;
+            int len = (int) length();
+            if (to > len) to = len;
+            if (from < to) {
+                memcpy(result.m_buffer, &m_buffer[from], to - from);
+                result.m_buffer[to - from] = 0;
+            }
+            return result;
+        }
+        String substring(int from) const { return substring(from, (int) length()); }
+
+    protected:
+        char m_buffer[64];
+
+        void set(const char* s)
+        {
+            strncpy(m_buffer, s, sizeof(m_buffer) - 1);
+            m_buffer[sizeof(m_buffer) - 1] = 0;
+        }
+};
+
+class Stream
+{
+    public:
+        int available();
+        int read();
+        void print(const char* s);
+        void println(const char* s);
+        void println(const String& s) { println(s.c_str()); }
+        void flush();
+};
+
+extern Stream Serial;
+
+#endif
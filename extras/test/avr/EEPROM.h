@@ -0,0 +1,21 @@
+// EEPROM.h
+//
+// Minimal AVR stand-in for the Arduino EEPROM library.
+
+#ifndef _EEPROM_AVR_STUB_h
+#define _EEPROM_AVR_STUB_h
+
+#include <stdint.h>
+#include <avr/eeprom.h>
+
+class EEPROMClass
+{
+    public:
+        uint8_t read(int location) { return eeprom_read_byte((const uint8_t*) location); }
+        void write(int location, uint8_t value) { eeprom_write_byte((uint8_t*) location, value); }
+        int length() { return E2END + 1; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,55 @@
+// Uses each part of the library so that linking with the AVR toolchain pulls all of it in.
+
+#include <ConfigLib.h>
+#include <EEPROM.h>
+
+struct LinkConfig
+{
+    int value;
+    char name[4];
+};
+
+static LinkConfig config = { 1, "AAA" };
+static unsigned char rawConfig[8];
+
+static void printConfigItemHelp(Configurator*) {}
+static void printConfig(Configurator*) {}
+static void setConfigItem(Configurator*, const char*, const char*) {}
+static void onWriteComplete(Configurator*, const char*, int, unsigned char) {}
+
+static boolean upgrade(unsigned char* image, int& imageLen, int bufferLen)
+{
+    return true;
+}
+
+static const ConfigMigration migrations[] = { upgrade };
+
+int main()
+{
+    Configurator configurator(&Serial, 0, 64);
+
+    configurator.registerSchema("LNK1", 1, migrations);
+    configurator.setWakePin(2);
+    configurator.initConfig("LNK1", config, printConfigItemHelp, printConfig, setConfigItem);
+    configurator.initConfig("LNK2", rawConfig, sizeof(rawConfig), printConfigItemHelp, printConfig, setConfigItem);
+
+    LinkConfig copy;
+    configurator.snapshot(copy);
+    configurator.trySnapshot(copy);
+
+    configurator.beginConfigUpdate();
+    config.value++;
+    configurator.endConfigUpdate();
+
+    configurator.store("LNK3", config);
+    configurator.load("LNK3", copy);
+
+    static unsigned char writeQueueBuffer[64];
+    BlockWriteQueue writeQueue(&configurator, writeQueueBuffer, sizeof(writeQueueBuffer));
+    writeQueue.save("LNK3", config, onWriteComplete);
+    while (writeQueue.numPending() > 0) {
+        writeQueue.poll();
+    }
+
+    return 0;
+}
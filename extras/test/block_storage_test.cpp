@@ -0,0 +1,307 @@
+// Tests of storing and loading tagged blocks in EEPROM.
+
+#include <ConfigLib.h>
+#include <EEPROM.h>
+
+static int numFailures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            numFailures++; \
+        } \
+    } while (0)
+
+static void eraseEEPROM()
+{
+    memset(EEPROM.data, 'X', sizeof(EEPROM.data));
+}
+
+// position of the first block with tag, found by looking for the tag itself
+static int findTag(const char* tag)
+{
+    for (int i = 0; i + EPROM_TAG_SIZE <= (int) sizeof(EEPROM.data); i++) {
+        if (memcmp(&EEPROM.data[i], tag, EPROM_TAG_SIZE) == 0) {
+            return i - 4;
+        }
+    }
+    return -1;
+}
+
+struct Small { int a; };
+struct Large { int a; int b; int c; };
+
+struct Reordered { short x; short y; };
+struct Swapped { short y; short x; };
+
+template<> struct ConfigLayout<Reordered> { static constexpr unsigned int id = 0x0101; };
+template<> struct ConfigLayout<Swapped> { static constexpr unsigned int id = 0x0102; };
+
+//#!*******************************************************************************************
+static void testStoreAndLoad()
+{
+    eraseEEPROM();
+    Configurator configurator(NULL, 0, 128);
+
+    Large stored = { 1, 2, 3 };
+    CHECK(configurator.store("CFG1", stored));
+
+    Large loaded = { 0, 0, 0 };
+    CHECK(configurator.load("CFG1", loaded));
+    CHECK(loaded.a == 1 && loaded.b == 2 && loaded.c == 3);
+
+    // a different size is rejected and leaves the value alone
+    Small small = { 9 };
+    CHECK(configurator.load("CFG1", small) == false);
+    CHECK(small.a == 9);
+}
+
+//#!*******************************************************************************************
+static void testLayoutIdMismatchIsRejected()
+{
+    eraseEEPROM();
+    Configurator configurator(NULL, 0, 128);
+
+    Reordered stored = { 1, 2 };
+    CHECK(configurator.store("CFG1", stored));
+
+    Swapped swapped = { 7, 7 };
+    CHECK(configurator.load("CFG1", swapped) == false);
+    CHECK(swapped.x == 7 && swapped.y == 7);
+}
+
+//#!*******************************************************************************************
+static void testCorruptBlockIsNotLoaded()
+{
+    eraseEEPROM();
+    Configurator configurator(NULL, 0, 128);
+
+    Small small = { 1 };
+    Small other = { 2 };
+    CHECK(configurator.store("CFG1", small));
+    CHECK(configurator.store("OTHR", other));
+
+    // corrupt the checksum of CFG1, which is the byte just before the next block
+    int otherPos = findTag("OTHR");
+    CHECK(otherPos > 0);
+    EEPROM.data[otherPos - 1] ^= 0xFF;
+
+    Large large = { 4, 5, 6 };
+    CHECK(configurator.store("CFG1", large));
+
+    Large loaded = { 0, 0, 0 };
+    CHECK(configurator.load("CFG1", loaded));
+    CHECK(loaded.a == 4 && loaded.b == 5 && loaded.c == 6);
+
+    CHECK(configurator.load("OTHR", other));
+    CHECK(other.a == 2);
+}
+
+//#!*******************************************************************************************
+static int lastWriteRc[2];
+static int numWriteCallbacks = 0;
+
+static void onWriteComplete(Configurator*, const char*, int rc, unsigned char)
+{
+    if (numWriteCallbacks < 2) {
+        lastWriteRc[numWriteCallbacks] = rc;
+    }
+    numWriteCallbacks++;
+}
+
+static void testQueuedSaveIsSuperseded()
+{
+    eraseEEPROM();
+    Configurator configurator(NULL, 0, 128);
+    unsigned char writeQueueBuffer[64];
+    BlockWriteQueue writeQueue(&configurator, writeQueueBuffer, sizeof(writeQueueBuffer));
+
+    Large first = { 1, 1, 1 };
+    Large second = { 2, 2, 2 };
+    CHECK(writeQueue.save("CFG1", first, onWriteComplete) == 0);
+    CHECK(writeQueue.save("CFG1", second, onWriteComplete) == 0);
+    CHECK(writeQueue.numPending() == 1);
+
+    writeQueue.poll();
+
+    CHECK(writeQueue.numPending() == 0);
+    CHECK(numWriteCallbacks == 2);
+    CHECK(lastWriteRc[0] == EPROM_WRITE_SUPERSEDED);
+    CHECK(lastWriteRc[1] == 0);
+
+    Large loaded = { 0, 0, 0 };
+    CHECK(configurator.load("CFG1", loaded));
+    CHECK(loaded.a == 2);
+}
+
+struct Big { unsigned char bytes[200]; };
+
+static void testQueueHoldsBlockOfBufferSize()
+{
+    eraseEEPROM();
+    Configurator configurator(NULL, 0, 128);
+    unsigned char writeQueueBuffer[sizeof(Big) + EPROM_BLOCK_OVERHEAD];
+    BlockWriteQueue writeQueue(&configurator, writeQueueBuffer, sizeof(writeQueueBuffer));
+
+    Big big;
+    memset(big.bytes, 7, sizeof(big.bytes));
+    CHECK(writeQueue.save("BIG1", big) == 0);
+    CHECK(writeQueue.save("BIG2", big) == -1);
+
+    writeQueue.poll();
+    CHECK(writeQueue.numPending() == 0);
+
+    Big loaded;
+    memset(loaded.bytes, 0, sizeof(loaded.bytes));
+    CHECK(configurator.load("BIG1", loaded));
+    CHECK(loaded.bytes[199] == 7);
+}
+
+struct Filler { unsigned char bytes[134]; };
+
+static void testResizedBlockIsRewrittenInPlaceWhenFull()
+{
+    eraseEEPROM();
+    Configurator configurator(NULL, 0, 128);
+
+    // a 25 byte block followed by blocks filling the rest of the region exactly
+    Large large = { 1, 2, 3 };
+    CHECK(configurator.store("CFG1", large));
+    Big big;
+    memset(big.bytes, 0, sizeof(big.bytes));
+    CHECK(configurator.store("FIL1", big));
+    CHECK(configurator.store("FIL2", big));
+    CHECK(configurator.store("FIL3", big));
+    CHECK(configurator.store("FIL4", big));
+    Filler filler;
+    memset(filler.bytes, 0, sizeof(filler.bytes));
+    CHECK(configurator.store("FIL5", filler));
+
+    // with nowhere else to go the smaller block replaces the old one where it is
+    Small small = { 5 };
+    CHECK(configurator.store("CFG1", small));
+    CHECK(memcmp(&EEPROM.data[0], "MGG2", 4) == 0);
+    CHECK(EEPROM.data[8] == sizeof(Small));
+
+    Small loaded = { 0 };
+    CHECK(configurator.load("CFG1", loaded));
+    CHECK(loaded.a == 5);
+    CHECK(configurator.load("FIL1", big));
+}
+
+//#!*******************************************************************************************
+static void printConfigItemHelp(Configurator*) {}
+static void printConfig(Configurator*) {}
+static void setConfigItem(Configurator*, const char*, const char*) {}
+
+// writes a block in the format used before layout ids and schema versions were added
+static void writeLegacyBlock(int location, const char* tag, const unsigned char* data, int dataLen)
+{
+    memcpy(&EEPROM.data[location], "MGGG", 4);
+    memcpy(&EEPROM.data[location + 4], tag, EPROM_TAG_SIZE);
+    EEPROM.data[location + 8] = (unsigned char) dataLen;
+    memcpy(&EEPROM.data[location + 9], data, dataLen);
+    EEPROM.data[location + 9 + dataLen] = 'X';  // checksum written by the dummy crc8
+}
+
+static boolean appendField(unsigned char* image, int& imageLen, int bufferLen)
+{
+    if (imageLen + 1 > bufferLen) return false;
+    image[imageLen++] = 42;
+    return true;
+}
+
+static boolean failMigration(unsigned char* image, int& imageLen, int bufferLen)
+{
+    return false;
+}
+
+static void testLegacyBlockIsLoaded()
+{
+    eraseEEPROM();
+    const unsigned char legacy[4] = { 7, 8, 9, 10 };
+    writeLegacyBlock(0, "CFG1", legacy, sizeof(legacy));
+
+    unsigned char config[4] = { 0, 0, 0, 0 };
+    Configurator configurator(NULL, 0, 128);
+    configurator.initConfig("CFG1", config, sizeof(config), printConfigItemHelp, printConfig, setConfigItem);
+
+    CHECK(memcmp(config, legacy, sizeof(legacy)) == 0);
+}
+
+static void testLegacyBlockIsMigrated()
+{
+    eraseEEPROM();
+    const unsigned char legacy[4] = { 7, 8, 9, 10 };
+    writeLegacyBlock(0, "CFG1", legacy, sizeof(legacy));
+
+    static const ConfigMigration migrations[] = { appendField };
+
+    unsigned char config[5] = { 0, 0, 0, 0, 0 };
+    Configurator configurator(NULL, 0, 128);
+    CHECK(configurator.registerSchema("CFG1", 1, migrations));
+    configurator.initConfig("CFG1", config, sizeof(config), printConfigItemHelp, printConfig, setConfigItem);
+
+    const unsigned char expected[5] = { 7, 8, 9, 10, 42 };
+    CHECK(memcmp(config, expected, sizeof(expected)) == 0);
+
+    // the upgraded block was written back in the current format after the legacy one, which stayed
+    // intact until the new copy was complete and was then retired
+    const int legacyBlockLen = 9 + sizeof(legacy) + 1;
+    CHECK(memcmp(&EEPROM.data[0], "XXXX", 4) == 0);
+    CHECK(memcmp(&EEPROM.data[legacyBlockLen], "MGG2", 4) == 0);
+    CHECK(memcmp(&EEPROM.data[legacyBlockLen + 4], "CFG1", EPROM_TAG_SIZE) == 0);
+
+    unsigned char reloaded[5] = { 0, 0, 0, 0, 0 };
+    configurator.initConfig("CFG1", reloaded, sizeof(reloaded), printConfigItemHelp, printConfig, setConfigItem);
+    CHECK(memcmp(reloaded, expected, sizeof(expected)) == 0);
+}
+
+static void testTypedInitConfigRejectsShortBlock()
+{
+    eraseEEPROM();
+    const unsigned char legacy[4] = { 5, 0, 0, 0 };
+    writeLegacyBlock(0, "CFG1", legacy, sizeof(legacy));
+
+    Large config = { 1, 2, 3 };
+    Configurator configurator(NULL, 0, 128);
+    configurator.initConfig("CFG1", config, printConfigItemHelp, printConfig, setConfigItem);
+
+    CHECK(config.a == 1 && config.b == 2 && config.c == 3);
+}
+
+static void testFailedMigrationKeepsDefaults()
+{
+    eraseEEPROM();
+    const unsigned char legacy[4] = { 1, 2, 3, 4 };
+    writeLegacyBlock(0, "CFG1", legacy, sizeof(legacy));
+
+    static const ConfigMigration migrations[] = { failMigration };
+
+    unsigned char config[6] = { 9, 9, 9, 9, 9, 9 };
+    Configurator configurator(NULL, 0, 128);
+    CHECK(configurator.registerSchema("CFG1", 1, migrations));
+    configurator.initConfig("CFG1", config, sizeof(config), printConfigItemHelp, printConfig, setConfigItem);
+
+    const unsigned char defaults[6] = { 9, 9, 9, 9, 9, 9 };
+    CHECK(memcmp(config, defaults, sizeof(defaults)) == 0);
+}
+
+//#!*******************************************************************************************
+int main()
+{
+    testStoreAndLoad();
+    testLayoutIdMismatchIsRejected();
+    testCorruptBlockIsNotLoaded();
+    testQueuedSaveIsSuperseded();
+    testQueueHoldsBlockOfBufferSize();
+    testResizedBlockIsRewrittenInPlaceWhenFull();
+    testLegacyBlockIsLoaded();
+    testTypedInitConfigRejectsShortBlock();
+    testLegacyBlockIsMigrated();
+    testFailedMigrationKeepsDefaults();
+
+    printf("%s\n", numFailures == 0 ? "All tests passed" : "Tests failed");
+    return numFailures == 0 ? 0 : 1;
+}
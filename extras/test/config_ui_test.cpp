@@ -0,0 +1,84 @@
+// Tests of the interactive config UI driven through the serial stand-in.
+
+#include <ConfigLib.h>
+#include <EEPROM.h>
+
+static int numFailures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            numFailures++; \
+        } \
+    } while (0)
+
+struct UiConfig { int value; };
+
+static UiConfig config;
+
+static void printConfigItemHelp(Configurator*) {}
+static void printConfig(Configurator*) {}
+
+static void setConfigItem(Configurator*, const char* key, const char* val)
+{
+    if (strcmp(key, "VALUE") == 0) {
+        config.value = atoi(val);
+    }
+}
+
+static void sendInput(const char* input)
+{
+    while (*input) {
+        Serial.input.push_back(*input++);
+    }
+}
+
+static boolean tagAt(int location, const char* tag)
+{
+    return memcmp(&EEPROM.data[location + 4], tag, EPROM_TAG_SIZE) == 0;
+}
+
+//#!*******************************************************************************************
+static void testWriteKeepsSettings()
+{
+    memset(EEPROM.data, 'X', sizeof(EEPROM.data));
+    config.value = 1;
+
+    // skip flag is stored first, then the config is written without a position
+    Configurator configurator(NULL, 1000, 128);
+    sendInput("C\rB:1\rS:VALUE,5\rW\rQ\r");
+    configurator.initConfig("CFG1", config, printConfigItemHelp, printConfig, setConfigItem);
+
+    // the next startup still has the skip flag and the written config
+    config.value = 0;
+    Configurator restarted(NULL, 1000, 128);
+    unsigned long start = millis();
+    restarted.initConfig("CFG1", config, printConfigItemHelp, printConfig, setConfigItem);
+
+    CHECK(millis() - start < 500);
+    CHECK(config.value == 5);
+}
+
+//#!*******************************************************************************************
+static void testWriteAtPosition()
+{
+    memset(EEPROM.data, 'X', sizeof(EEPROM.data));
+    config.value = 3;
+
+    Configurator configurator(NULL, 1000, 128);
+    sendInput("C\rW:100\rQ\r");
+    configurator.initConfig("CFG1", config, printConfigItemHelp, printConfig, setConfigItem);
+
+    CHECK(tagAt(100, "CFG1"));
+}
+
+//#!*******************************************************************************************
+int main()
+{
+    testWriteKeepsSettings();
+    testWriteAtPosition();
+
+    printf("%s\n", numFailures == 0 ? "All tests passed" : "Tests failed");
+    return numFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// Stress test of Configurator snapshots.
+//
+// A writer thread repeatedly updates the registered config through beginConfigUpdate /
+// endConfigUpdate while reader threads take snapshots. Every update writes the same value
+// to every field, so any snapshot whose fields differ was torn.
+
+#include <ConfigLib.h>
+#include <EEPROM.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define NUM_READERS 4
+#define NUM_UPDATES 200000
+#define NUM_FIELDS 16
+
+struct StressConfig
+{
+    unsigned int fields[NUM_FIELDS];
+};
+
+static StressConfig config;
+
+static void printConfigItemHelp(Configurator*) {}
+static void printConfig(Configurator*) {}
+static void setConfigItem(Configurator*, const char*, const char*) {}
+
+int main()
+{
+    memset(EEPROM.data, 'X', sizeof(EEPROM.data));
+
+    // no stream and no select period so initConfig just registers the config
+    Configurator configurator(NULL, 0, 128);
+    configurator.initConfig("STRS", config, printConfigItemHelp, printConfig, setConfigItem);
+
+    std::atomic<bool> stop(false);
+    std::atomic<long> numSnapshots(0);
+    std::atomic<long> numTorn(0);
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < NUM_READERS; r++) {
+        readers.push_back(std::thread([&]() {
+            while (stop.load() != true) {
+                StressConfig copy;
+                if (configurator.snapshot(copy) != true) {
+                    numTorn++;
+                    continue;
+                }
+
+                for (int i = 1; i < NUM_FIELDS; i++) {
+                    if (copy.fields[i] != copy.fields[0]) {
+                        numTorn++;
+                        break;
+                    }
+                }
+                numSnapshots++;
+            }
+        }));
+    }
+
+    for (unsigned int n = 1; n <= NUM_UPDATES; n++) {
+        configurator.beginConfigUpdate();
+        for (int i = 0; i < NUM_FIELDS; i++) {
+            __atomic_store_n(&config.fields[i], n, __ATOMIC_RELAXED);
+        }
+        configurator.endConfigUpdate();
+    }
+
+    stop = true;
+    for (size_t r = 0; r < readers.size(); r++) {
+        readers[r].join();
+    }
+
+    printf("snapshots [%ld] torn [%ld]\n", numSnapshots.load(), numTorn.load());
+
+    return (numTorn.load() == 0 && numSnapshots.load() > 0) ? 0 : 1;
+}
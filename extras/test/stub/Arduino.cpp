@@ -0,0 +1,29 @@
+#include "Arduino.h"
+#include "EEPROM.h"
+
+#include <chrono>
+#include <thread>
+
+Stream Serial;
+EEPROMClass EEPROM;
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+    return (unsigned long) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void pinMode(int pin, int mode)
+{
+}
+
+int digitalRead(int pin)
+{
+    return HIGH;
+}
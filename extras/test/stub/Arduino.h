@@ -0,0 +1,79 @@
+// Arduino.h
+//
+// Minimal host stand-in for the parts of the Arduino core used by ConfigLib,
+// so that the library can be built and tested on the host.
+
+#ifndef _ARDUINO_STUB_h
+#define _ARDUINO_STUB_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <deque>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+#define HEX 16
+#define LOW 0
+#define HIGH 1
+#define INPUT_PULLUP 2
+
+unsigned long millis();
+void delay(unsigned long ms);
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+
+class String : public std::string
+{
+    public:
+        String(const char* s = "") : std::string(s) {}
+        String(const std::string& s) : std::string(s) {}
+        String(const __FlashStringHelper* s) : std::string((const char*) s) {}
+        String(int value, int base = 10)
+        {
+            char buffer[16];
+            snprintf(buffer, sizeof(buffer), base == HEX ? "%x" : "%d", value);
+            assign(buffer);
+        }
+
+        String& operator+=(const char* s) { append(s); return *this; }
+        String& operator+=(char c) { push_back(c); return *this; }
+        String& operator+=(int value) { append(std::to_string(value)); return *this; }
+        String& operator+=(const String& s) { append(s); return *this; }
+
+        int indexOf(char c) const { size_t pos = find(c); return pos == npos ? -1 : (int) pos; }
+        String substring(int from, int to) const { return String(substr(from, to - from)); }
+        String substring(int from) const { return String(substr(from)); }
+};
+
+// Stream whose input is queued by the test and whose output goes to stdout
+class Stream
+{
+    public:
+        std::deque<int> input;
+
+        int available() { return (int) input.size(); }
+        int read()
+        {
+            if (input.empty()) return -1;
+            int c = input.front();
+            input.pop_front();
+            return c;
+        }
+
+        void print(const char* s) { fputs(s, stdout); }
+        void println(const char* s) { puts(s); }
+        void println(const String& s) { puts(s.c_str()); }
+        void flush() { fflush(stdout); }
+};
+
+extern Stream Serial;
+
+#endif
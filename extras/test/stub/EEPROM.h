@@ -0,0 +1,22 @@
+// EEPROM.h
+//
+// Host stand-in for the Arduino EEPROM library backed by a RAM array.
+
+#ifndef _EEPROM_STUB_h
+#define _EEPROM_STUB_h
+
+#include <stdint.h>
+
+class EEPROMClass
+{
+    public:
+        uint8_t data[1024];
+
+        uint8_t read(int location) { return data[location]; }
+        void write(int location, uint8_t value) { data[location] = value; }
+        int length() { return (int) sizeof(data); }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif